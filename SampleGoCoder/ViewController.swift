@@ -20,7 +20,19 @@ class ViewController: UIViewController {
     var config: WowzaConfig!
     var encoder = WOWZH264Encoder()
     var audioDevice = WOWZAudioDevice()
-    var audioEncoder = WOWZAACEncoder()
+    // Last state applied to the UI from onWOWZStatus/onWOWZError; main thread only.
+    var broadcastState = WOWZState.idle
+    // Status and event notifications collapsed into a repeat; main thread only.
+    private(set) var coalescedStatusCount = 0
+    // Events waiting for the next main-queue flush, at most one per WOWZEvent.
+    // Written from SDK threads, so guarded by eventLock.
+    private var pendingEvents: [(event: WOWZEvent, data: [AnyHashable: Any]?)] = []
+    private var pendingCoalescedEvents = 0
+    private let eventLock = NSLock()
+    // Host time of the Start tap, used to report time-to-running.
+    var startTapTime: CFTimeInterval = 0
+    // Preferred mic capture period, applied on each Start; the system default is ~23 ms.
+    var preferredAudioIOBufferDuration: TimeInterval = 0.005
 
     @IBOutlet weak var container: UIView!
     override func viewDidLoad() {
@@ -55,10 +67,24 @@ class ViewController: UIViewController {
         config.audioChannels = 1
     }
     
+    private func setupLowLatencyAudio() {
+        // Ask for short capture periods so mic audio reaches WOWZAudioDevice sooner.
+        // The system may round this to what the hardware supports; the value in
+        // use is logged once the broadcast is running.
+        let session = AVAudioSession.sharedInstance()
+        do {
+            try session.setPreferredIOBufferDuration(preferredAudioIOBufferDuration)
+        } catch {
+            debugPrint("Error: setPreferredIOBufferDuration [\(error)]")
+        }
+    }
+    
     @IBAction func broadcastTap(_ sender: UIButton) {
         if broadcaster.status.state == WOWZState.running {
             broadcaster.end(self)
         } else {
+            startTapTime = CACurrentMediaTime()
+            setupLowLatencyAudio()
             broadcaster.start(config, statusCallback: self)
         }
         
@@ -92,16 +118,35 @@ class ViewController: UIViewController {
 
 extension ViewController: WOWZStatusCallback {
     func onWOWZStatus(_ status: WOWZStatus!) {
-        switch status.state {
+        // Called on whichever SDK thread changed state; hop off it right away so
+        // UI and ReplayKit work never stalls the broadcast pipeline.
+        let state = status.state
+        DispatchQueue.main.async {
+            self.applyStatus(state)
+        }
+    }
+    
+    private func applyStatus(_ state: WOWZState) {
+        guard state != broadcastState else {
+            coalescedStatusCount += 1
+            return
+        }
+        broadcastState = state
+        switch state {
         case .running:
             button.setTitle("Stop", for: .normal)
+            print("Broadcast running \(Int((CACurrentMediaTime() - startTapTime) * 1000)) ms after tap")
+            print("Audio IO buffer duration \(AVAudioSession.sharedInstance().ioBufferDuration * 1000) ms (preferred \(preferredAudioIOBufferDuration * 1000) ms)")
             RPScreenRecorder.shared().startCapture(handler: { (buffer, type, error) in
                 switch type {
                 case .video:
                     if let imgBuffer = CMSampleBufferGetImageBuffer(buffer) {
+                        // Forward ReplayKit's PTS unchanged; rescaling it here would put
+                        // video on a different timebase from the rest of the stream.
                         let pts = CMSampleBufferGetPresentationTimeStamp(buffer)
-                        let newPts = CMTimeMake(pts.value / 1000, pts.timescale)
+                        #if DEBUG
                         print(pts.seconds)
+                        #endif
                         self.encoder.videoFrameWasCaptured(imgBuffer, framePresentationTime: pts, frameDuration: kCMTimeInvalid)
                     }
                     break
@@ -133,6 +178,43 @@ extension ViewController: WOWZStatusCallback {
         default:
             button.setTitle("Start", for: .normal)
             RPScreenRecorder.shared().stopCapture(handler: nil)
+            if state == .idle {
+                print("Broadcast idle, coalesced \(coalescedStatusCount) notifications")
+            }
+        }
+    }
+    
+    func onWOWZEvent(_ status: WOWZStatus!) {
+        // Repeats of an event still waiting for the main queue, such as a burst of
+        // BitrateReduced, replace the queued one so only the latest data is applied.
+        let event = status.event
+        let data = status.data
+        eventLock.lock()
+        let flushScheduled = !pendingEvents.isEmpty
+        if let index = pendingEvents.index(where: { $0.event == event }) {
+            pendingEvents[index].data = data
+            pendingCoalescedEvents += 1
+        } else {
+            pendingEvents.append((event: event, data: data))
+        }
+        eventLock.unlock()
+        if !flushScheduled {
+            DispatchQueue.main.async {
+                self.flushEvents()
+            }
+        }
+    }
+    
+    private func flushEvents() {
+        eventLock.lock()
+        let events = pendingEvents
+        let coalesced = pendingCoalescedEvents
+        pendingEvents.removeAll()
+        pendingCoalescedEvents = 0
+        eventLock.unlock()
+        coalescedStatusCount += coalesced
+        for (event, data) in events {
+            print("Broadcast event \(event.rawValue) \(data ?? [:])")
         }
     }
     
@@ -147,6 +229,16 @@ extension ViewController: WOWZStatusCallback {
     
     func onWOWZError(_ status: WOWZStatus!) {
         print(status.error!)
+        // A failed broadcast may only be reported here, so route its state through
+        // the same path as onWOWZStatus to reset the button and stop capture.
+        let state = status.state
+        DispatchQueue.main.async {
+            // A non-fatal error leaves the state unchanged; that is not a coalesced repeat.
+            guard state != self.broadcastState else {
+                return
+            }
+            self.applyStatus(state)
+        }
     }
 }
 
@@ -156,7 +248,17 @@ extension ViewController: WOWZVideoSink, WOWZAudioSink {
     }
     
     func audioFrameWasCaptured(_ data: UnsafeMutableRawPointer, size: UInt32, time: CMTime, sampleRate: Float64) {
-        print("AUdiopts \(time.seconds)")
+        #if DEBUG
+        guard time.isNumeric else {
+            print("AUdiopts invalid")
+            return
+        }
+        // Unverified: only meaningful if the SDK stamps audio on the host clock;
+        // WOWZAudioSink.h just calls this "the audio frame time".
+        let now = CMClockGetTime(CMClockGetHostTimeClock())
+        let delta = CMTimeGetSeconds(CMTimeSubtract(now, time))
+        print("AUdiopts \(time.seconds) host-clock delta \(delta * 1000) ms")
+        #endif
     }
 }
 